@@ -12,6 +12,8 @@
 #include <TChain.h>
 #include <TFile.h>
 
+#include <vector>
+
 // Header file for the classes stored in the TTree if any.
 
 class TBDisplay {
@@ -87,6 +89,9 @@ public :
    TBDisplay(TList *f=0);
    virtual ~TBDisplay();
    virtual Int_t    Cut(Long64_t entry);
+   virtual void     SetTimeWindow(Float_t tmin, Float_t tmax = -1);
+   virtual void     SetAcquisition(Float_t aq_sec, Float_t aqdelay_sec);
+   virtual Int_t    NextInWindow(Int_t ev, Int_t step);
    virtual Int_t    GetEntry(Long64_t entry);
    virtual Long64_t LoadTree(Long64_t entry);
    virtual void     Init(TTree *tree);
@@ -101,17 +106,100 @@ public :
    virtual void     DropEvent();
    virtual Bool_t   GotoEvent(Int_t ev);
    virtual void     MakeViewerScene(TEveWindowSlot* slot, TEveViewer*& v, TEveScene*& s);
-   virtual void     LoadHits(TEvePointSet*& ps,int i);
-   virtual void     LoadHits_Box(TEveBoxSet*& bs,int i);
-   virtual void     ColorBar();
+   virtual void     ColorBar(Float_t emax = 10);
+
+   virtual void     BuildSpillIndex();
+   virtual Int_t    FindSpill(Int_t ev);
+   virtual Bool_t   SpillInWindow(Int_t is);
+   virtual void     NextSpill();
+   virtual void     PrevSpill();
+   virtual Bool_t   GotoSpill(Int_t is);
+
+   virtual void     SetPlayRate(Float_t rate);
+   virtual void     Play();
+   virtual void     Stop();
+   virtual void     PlayStep();
+
+   virtual void     BuildLOD(Float_t emax = 10);
+   virtual TEveBoxSet* MakeCellSet(const char* name, Int_t block, Float_t emax);
+   virtual TEveBoxSet* MakeBlockSet();
+   virtual void     RebuildBlocks();
+   virtual void     SetLODLevel(Bool_t fine);
+   virtual void     SetLODCellPixels(Float_t px);
+   virtual Double_t CellPixels();
+   virtual void     UpdateLOD();
+   virtual void     ExpandBlock(TEveDigitSet* ds, Int_t idx);
+
+   virtual void     Calib();
+   virtual Bool_t   LoadCalibration(TString filename);
+   virtual void     ClearCalibration();
+   virtual void     SetGainSwitch(Int_t adc);
+   virtual void     Recalibrate();
+   virtual void     Redisplay();
 
-   TEvePointSet  *fHits;
    TEveBoxSet  *fHits_Box;
 
    TEventList *evlist;
    Int_t fMaxEv, fCurEv;
    TCut coin = "nhit_slab >= 13";
 
+   // Spill / cycle index, filled once by BuildSpillIndex()
+   struct SpillRange {
+      Int_t spill;
+      Int_t first, last;        // positions in evlist
+      Int_t cycleMin, cycleMax;
+   };
+   std::vector<Int_t> fEntrySpill;   // spill of every tree entry
+   std::vector<Int_t> fEntryCycle;   // cycle of every tree entry
+   std::vector<SpillRange> fSpills;  // spills of the selected events
+   Int_t fCurSpill;
+
+   // Acquisition timing and time window (s, and in cycles) used by Cut()
+   Float_t fAqSec, fAqDelaySec;
+   Float_t fTimeMin, fTimeMax;
+   Int_t fCycleMin, fCycleMax;
+
+   // Autoplay: one frame every 1/fPlayRate s, times in ms from gSystem->Now()
+   TTimer  *fPlayTimer;
+   Float_t  fPlayRate;
+   Int_t    fPlayNext, fPlayFrame, fPlayShown, fPlayDropped;
+   Long64_t fPlayT0, fPlayDue, fPlayLate;
+   TStopwatch fPlayWatch;
+   Double_t fPlayBuild;          // s spent in GotoEvent()
+
+   // Level of detail: cells of the shown event (or spill) and their
+   // per-(slab, chip) blocks, drawn as summed-energy boxes while a cell
+   // is at most fLODCellPixels high on screen.
+   struct LODCell {
+      Float_t x, y, z, e;
+      Int_t slab, chip, chan, sca;   // sca < 0: summed over a spill
+      Int_t adc_high, isHit, nhits;
+      Int_t block;
+   };
+   struct LODBlock {
+      Int_t slab, chip, ncells;
+      Float_t xmin, xmax, ymin, ymax, z, e;
+      Bool_t expanded;
+   };
+   std::vector<LODCell>  fLODCells;
+   std::vector<LODBlock> fLODBlocks;
+   TEveBoxSet *fHits_Coarse;
+   std::vector<Int_t> fCoarseDigitBlock;  // block of each digit of fHits_Coarse
+   std::vector<TEveBoxSet*> fPickedSets;  // cells of blocks expanded by picking
+   TTimer  *fLODTimer;
+   Float_t  fLODCellPixels;
+   Bool_t   fLODFine, fLODRendered;
+   Float_t  fEmaxFine, fEmaxCoarse;
+   TEveRGBAPaletteOverlay *fColorBar;
+
+   // Calibration tables, flat over (slab, chip, chan, sca) with one extra
+   // all-zero entry for hits outside the table.
+   std::vector<Float_t> fPedHigh, fPedLow, fInvMipHigh, fGain;
+   // Per-hit columns gathered from the tables by Recalibrate()
+   std::vector<Float_t> fHitPedHigh, fHitPedLow, fHitInvMip, fHitGain;
+   Bool_t  fUseCalib;
+   Int_t   fGainSwitch;   // hit_adc_high from which low gain is used
+
    TFile *OutFile;
    TString InFileName;
    TString OutFileName;
@@ -123,7 +211,12 @@ public :
 
 #ifdef TBDisplay_cxx
 
-TBDisplay::TBDisplay(TString filein_s) : fChain(0), fMaxEv(-1), fCurEv(-1)
+TBDisplay::TBDisplay(TString filein_s) : fChain(0), fHits_Box(0), fMaxEv(-1), fCurEv(-1), fCurSpill(-1),
+   fAqSec(0.001), fAqDelaySec(0.01), fTimeMin(0), fTimeMax(-1), fCycleMin(0), fCycleMax(-1),
+   fPlayTimer(0), fPlayRate(10), fPlayT0(-1),
+   fHits_Coarse(0), fLODTimer(0), fLODCellPixels(10), fLODFine(kTRUE), fLODRendered(kFALSE),
+   fColorBar(0),
+   fUseCalib(kFALSE), fGainSwitch(3000)
 {
    InFileName = filein_s;
    TFile *f = new TFile(InFileName);
@@ -137,9 +230,15 @@ TBDisplay::TBDisplay(TString filein_s) : fChain(0), fMaxEv(-1), fCurEv(-1)
    fMaxEv = fChain->GetEntries(coin);
 
    Init(tree);
+   BuildSpillIndex();
 }
 
-TBDisplay::TBDisplay(TList *f) : fChain(0) 
+TBDisplay::TBDisplay(TList *f) : fChain(0), fHits_Box(0), fCurSpill(-1),
+   fAqSec(0.001), fAqDelaySec(0.01), fTimeMin(0), fTimeMax(-1), fCycleMin(0), fCycleMax(-1),
+   fPlayTimer(0), fPlayRate(10), fPlayT0(-1),
+   fHits_Coarse(0), fLODTimer(0), fLODCellPixels(10), fLODFine(kTRUE), fLODRendered(kFALSE),
+   fColorBar(0),
+   fUseCalib(kFALSE), fGainSwitch(3000)
 {
    TIter next(f);
    TSystemFile *file;
@@ -155,6 +254,8 @@ TBDisplay::TBDisplay(TList *f) : fChain(0)
 
 TBDisplay::~TBDisplay()
 {
+   delete fPlayTimer;
+   delete fLODTimer;
    if (!fChain) return;
    delete fChain->GetCurrentFile();
 }
@@ -246,19 +347,42 @@ void TBDisplay::Show(Long64_t entry)
 }
 Int_t TBDisplay::Cut(Long64_t entry)
 {
+// Acquisition-cycle time window, looked up in the spill index so that
+// the entry itself does not have to be read.
+   if (entry < 0 || entry >= (Long64_t)fEntryCycle.size()) return -1;
 
-   float CutTime     = 300.0;
-   float aq_sec      = 0.001;
-   float aqdelay_sec = 0.01;
-   float spc = aq_sec + aqdelay_sec;
-
-   int ncycles = (int)(CutTime / spc);
-
-   if(cycle < ncycles) {
+   Int_t c = fEntryCycle[entry];
+   if (c < fCycleMin || (fCycleMax >= 0 && c >= fCycleMax)) {
       return -1;
    }else{
       return 1;
    }
    
 }
+void TBDisplay::SetTimeWindow(Float_t tmin, Float_t tmax)
+{
+// Keep cycles in [tmin, tmax) seconds from the start of the run.
+// A negative tmax leaves the window open-ended.
+   float spc = fAqSec + fAqDelaySec;
+
+   fTimeMin  = tmin;
+   fTimeMax  = tmax;
+   fCycleMin = (int)(tmin / spc);
+   fCycleMax = (tmax < 0) ? -1 : (int)(tmax / spc);
+
+   Redisplay();
+}
+void TBDisplay::SetAcquisition(Float_t aq_sec, Float_t aqdelay_sec)
+{
+// Acquisition and delay time of one cycle, used to convert the time
+// window to cycles.
+   if (aq_sec < 0 || aqdelay_sec < 0 || aq_sec + aqdelay_sec <= 0) {
+      Warning("SetAcquisition", "Invalid cycle timing %f + %f s.", aq_sec, aqdelay_sec);
+      return;
+   }
+   fAqSec      = aq_sec;
+   fAqDelaySec = aqdelay_sec;
+
+   SetTimeWindow(fTimeMin, fTimeMax);
+}
 #endif // #ifdef TBDisplay_cxx
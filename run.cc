@@ -83,6 +83,32 @@ void make_gui()
    }
    frmMain->AddFrame(hf);
 
+   hf = new TGHorizontalFrame(frmMain);
+   {
+      TGTextButton* b = 0;
+
+      b = new TGTextButton(hf, "<< Spill");
+      hf->AddFrame(b);
+      b->Connect("Clicked()", "TBDisplay", gDisplay, "PrevSpill()");
+
+      b = new TGTextButton(hf, "Spill >>");
+      hf->AddFrame(b);
+      b->Connect("Clicked()", "TBDisplay", gDisplay, "NextSpill()");
+
+      b = new TGTextButton(hf, "Play");
+      hf->AddFrame(b);
+      b->Connect("Clicked()", "TBDisplay", gDisplay, "Play()");
+
+      b = new TGTextButton(hf, "Stop");
+      hf->AddFrame(b);
+      b->Connect("Clicked()", "TBDisplay", gDisplay, "Stop()");
+
+      b = new TGTextButton(hf, "Calib");
+      hf->AddFrame(b);
+      b->Connect("Clicked()", "TBDisplay", gDisplay, "Calib()");
+   }
+   frmMain->AddFrame(hf);
+
    frmMain->MapSubwindows();
    frmMain->Resize();
    frmMain->MapWindow();
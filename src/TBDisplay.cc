@@ -20,12 +20,20 @@
 #include <TFile.h>
 #include <TKey.h>
 #include <TSystem.h>
+#include <TTimer.h>
+#include <TStopwatch.h>
+#include <TGLViewer.h>
+#include <TGLCamera.h>
+#include <TGLPerspectiveCamera.h>
 #include <TPRegexp.h>
+#include <TMath.h>
 
 #include <algorithm> // for std::find
 #include <iterator> // for std::begin, std::end
 #include <string>
 #include <map>
+#include <fstream>
+#include <sstream>
 
 #include "../include/TBDisplay.hh"
 #include "../include/MultiView.hh"
@@ -37,27 +45,94 @@ using std::endl;
 const bool debug = false;
 const int nslabs = 15;
 const int nscas = 15;
+const int nchips = 16;
+const int nchans = 64;
 const float beamX = 20.0, beamY = 15.0;
-const float MARKER_SIZE = 3.5;
+const int PALETTE_STEPS = 1000;
+const float CELL_SIZE = 5.0;
+
+// Tooltips are formatted only when asked for; each digit points to its
+// LODCell / LODBlock, which live until the next DropEvent().
+static TString CellTooltip(TEveDigitSet* ds, Int_t idx)
+{
+   const TBDisplay::LODCell *c = (const TBDisplay::LODCell*)ds->GetUserData(idx);
+   if (c == 0) return TString();
+   if (c->sca < 0)
+      return TString::Format("sum_energy=%f\n nhits=%i\n (%i,%i,%i)",
+                             c->e, c->nhits, c->slab, c->chip, c->chan);
+   return TString::Format("hit_adc_high=%i\n hit_energy=%f\n hit_isHit=%i\n (%i,%i,%i,%i)",
+                          c->adc_high, c->e, c->isHit,
+                          c->slab, c->chip, c->chan, c->sca);
+}
+
+static TString BlockTooltip(TEveDigitSet* ds, Int_t idx)
+{
+   const TBDisplay::LODBlock *b = (const TBDisplay::LODBlock*)ds->GetUserData(idx);
+   if (b == 0) return TString();
+   return TString::Format("sum_energy=%f\n ncells=%i\n (%i,%i)",
+                          b->e, b->ncells, b->slab, b->chip);
+}
+
+// Digit values are integers; map [0, emax] onto [0, PALETTE_STEPS] so that
+// sub-MIP energies keep their colour.
+static Int_t DigitOf(Float_t e, Float_t emax)
+{
+   return TMath::Nint(e / emax * PALETTE_STEPS);
+}
+
+// Palette shared by cells and blocks; negative energies (e.g. after
+// pedestal subtraction) take the lowest colour rather than vanishing.
+static TEveRGBAPalette* LODPalette()
+{
+   TEveRGBAPalette *pal = new TEveRGBAPalette(0, PALETTE_STEPS);
+   pal->SetUnderflowAction(TEveRGBAPalette::kLA_Clip);
+   pal->SetupColorArray();
+   return pal;
+}
 
 void TBDisplay::Next()
 {
-   GotoEvent(fCurEv + 1);
+   Stop();
+   Int_t ev = NextInWindow(fCurEv + 1, 1);
+   if (ev < 0) {
+      Warning("Next", "No further event in the time window.");
+      return;
+   }
+   GotoEvent(ev);
 }
 
 void TBDisplay::Prev()
 {
-   GotoEvent(fCurEv - 1);
+   Stop();
+   Int_t ev = NextInWindow(fCurEv - 1, -1);
+   if (ev < 0) {
+      Warning("Prev", "No earlier event in the time window.");
+      return;
+   }
+   GotoEvent(ev);
 }
 
 void TBDisplay::GoTo() {
 
+   Stop();
 	int goto_eventNum;
 	cout << "Go To: ";
 	cin >> goto_eventNum;
 	cout << endl;
 
-   GotoEvent(goto_eventNum);
+   if (goto_eventNum < 0 || goto_eventNum >= fMaxEv) {
+      Warning("GoTo", "Invalid event id %d.", goto_eventNum);
+      return;
+   }
+
+   Int_t ev = NextInWindow(goto_eventNum, 1);
+   if (ev < 0) {
+      Warning("GoTo", "No event in the time window from %d on.", goto_eventNum);
+      return;
+   }
+   if (ev != goto_eventNum)
+      cout << "Event " << goto_eventNum << " is outside the time window." << endl;
+   GotoEvent(ev);
 
 }
 
@@ -65,6 +140,15 @@ void TBDisplay::DropEvent()
 {   
    gEve->GetViewers()->DeleteAnnotations();
    gEve->GetCurrentEvent()->DestroyElements();
+
+   if (fLODTimer) fLODTimer->TurnOff();
+
+   fHits_Box    = 0;
+   fHits_Coarse = 0;
+   fPickedSets.clear();
+   fCoarseDigitBlock.clear();
+   fLODCells.clear();
+   fLODBlocks.clear();
 }
 
 Bool_t TBDisplay::GotoEvent(Int_t ev)
@@ -88,6 +172,7 @@ Bool_t TBDisplay::GotoEvent(Int_t ev)
 
    TGraph2D *gr = new TGraph2D();
    fCurEv = ev;
+   fCurSpill = -1;
 
    Long64_t ientry = LoadTree( evlist->GetEntry(ev) );
    if (ientry == 0) {
@@ -96,17 +181,20 @@ Bool_t TBDisplay::GotoEvent(Int_t ev)
    }
 
    nb = fChain->GetEntry(evlist->GetEntry(ev));
+   if (fUseCalib) Recalibrate();
 
    // Load event data into visualization structures.
+   fLODCells.reserve(nhit_len);
    for (int ihit=0; ihit<nhit_len; ihit++){
-      
-      // LoadHits(fHits,ihit);
-      LoadHits_Box(fHits_Box,ihit);
+
+      LODCell c = {hit_x[ihit], hit_y[ihit], hit_z[ihit], hit_energy[ihit],
+                   hit_slab[ihit], hit_chip[ihit], hit_chan[ihit], hit_sca[ihit],
+                   hit_adc_high[ihit], hit_isHit[ihit], 1, -1};
+      fLODCells.push_back(c);
 
    } // hit loop
 
-   // Add overlayed color bar
-   ColorBar();
+   BuildLOD();
 
    gEve->Redraw3D(kFALSE, kTRUE);
 
@@ -126,73 +214,674 @@ void TBDisplay::MakeViewerScene(TEveWindowSlot* slot, TEveViewer*& v, TEveScene*
    v->AddScene(s);
 }
 
-void TBDisplay::LoadHits(TEvePointSet*& ps, int i)
+void TBDisplay::ColorBar(Float_t emax)
+{
+   TEveRGBAPalette *pal = new TEveRGBAPalette(0, emax);
+   pal->SetupColorArray();
+   auto po = new TEveRGBAPaletteOverlay(pal, 0.55, 0.1, 0.4, 0.05);
+   auto v  = gEve->GetDefaultGLViewer();
+   if (fColorBar) {
+      v->RemoveOverlayElement(fColorBar);
+      delete fColorBar;
+   }
+   v->AddOverlayElement(po);
+   fColorBar = po;
+}
+
+//______________________________________________________________________________
+void TBDisplay::BuildSpillIndex()
 {
-   ps = new TEvePointSet("Hit");
-   ps->SetOwnIds(kTRUE);
-   ps->SetMarkerSize(MARKER_SIZE);
-   ps->SetMarkerStyle(54);
-   ps->IncDenyDestroy();
+   // Single pass over the tree reading only the spill and cycle branches.
+   // Spill boundaries are then found on the selected events (evlist).
+
+   fEntrySpill.clear();
+   fEntryCycle.clear();
+   fSpills.clear();
+   if (fChain == 0) return;
+
+   Long64_t nentries = fChain->GetEntriesFast();
+   fEntrySpill.resize(nentries);
+   fEntryCycle.resize(nentries);
+
+   for (Long64_t jentry=0; jentry<nentries; jentry++){
+      Long64_t ientry = LoadTree(jentry);
+      if (ientry < 0) break;
+      b_spill->GetEntry(ientry);
+      b_cycle->GetEntry(ientry);
+      fEntrySpill[jentry] = spill;
+      fEntryCycle[jentry] = cycle;
+   }
 
-   ps->SetNextPoint(hit_x[i],hit_y[i],hit_z[i]);
-   // ps->SetMainColor(TColor::GetColorPalette
-   //                  (hit_adc_high[i]));
-   ps->SetMainColor(TColor::GetColorPalette
-                    (hit_energy[i]));
-   if(hit_adc_high[i] < hit_energy[i]) ps->SetMainColor(kRed);
-   // if(hit_energy[i] > 700) ps->SetMainColor(kRed);
-   // ps->SetMainColor(TColor::GetColorPalette
-   //                  (hit_energy[i]));
-   ps->SetPointId(new TNamed(Form("Point %d", i), ""));
-   ps->SetTitle(TString::Format("hit_adc_high=%i\n hit_energy=%f\n hit_isHit=%i\n (%i,%i,%i,%i)",
-                                 hit_adc_high[i],
-                                 hit_energy[i],
-                                 hit_isHit[i],
-                                 hit_slab[i], hit_chip[i], hit_chan[i], hit_sca[i]));
+   for (Int_t ev=0; ev<fMaxEv; ev++){
+      Long64_t entry = evlist->GetEntry(ev);
+      Int_t sp = fEntrySpill[entry];
+      Int_t cy = fEntryCycle[entry];
+
+      if (fSpills.empty() || fSpills.back().spill != sp){
+         SpillRange r = {sp, ev, ev, cy, cy};
+         fSpills.push_back(r);
+      }else{
+         SpillRange &r = fSpills.back();
+         r.last = ev;
+         r.cycleMin = std::min(r.cycleMin, cy);
+         r.cycleMax = std::max(r.cycleMax, cy);
+      }
+   } // event loop
+
+   cout << "Indexed " << fSpills.size() << " spills in "
+        << fMaxEv << " selected events." << endl;
+}
 
-   gEve->AddElement(ps);
+Int_t TBDisplay::FindSpill(Int_t ev)
+{
+   // Index of the spill holding the selected event ev, -1 if none.
+
+   if (ev < 0 || fSpills.empty()) return -1;
+
+   Int_t lo = 0, hi = fSpills.size() - 1;
+   while (lo < hi){
+      Int_t mid = (lo + hi + 1) / 2;
+      if (fSpills[mid].first <= ev) lo = mid;
+      else hi = mid - 1;
+   }
+   return (ev <= fSpills[lo].last) ? lo : -1;
 }
 
-void TBDisplay::LoadHits_Box(TEveBoxSet*& bs, int i)
+Int_t TBDisplay::NextInWindow(Int_t ev, Int_t step)
 {
-   bs = new TEveBoxSet("BoxSet");
-   TEveRGBAPalette *pal = new TEveRGBAPalette(0, 10);
-   pal->SetupColorArray();
-   bs->SetPalette(pal);
+   // First selected event from ev on, stepping by +-1, that passes Cut();
+   // -1 if none. Spills entirely outside the window are skipped at once.
+
+   while (ev >= 0 && ev < fMaxEv){
+      Int_t is = FindSpill(ev);
+      if (is >= 0 && !SpillInWindow(is)){
+         ev = (step > 0) ? fSpills[is].last + 1 : fSpills[is].first - 1;
+         continue;
+      }
+      if (Cut(evlist->GetEntry(ev)) >= 0) return ev;
+      ev += step;
+   }
+   return -1;
+}
 
-   bs->Reset(TEveBoxSet::kBT_AABox, kFALSE, 64);
+Bool_t TBDisplay::SpillInWindow(Int_t is)
+{
+   // Whether any cycle of spill is can pass the time window of Cut().
+
+   const SpillRange &r = fSpills[is];
+   if (r.cycleMax < fCycleMin) return kFALSE;
+   if (fCycleMax >= 0 && r.cycleMin >= fCycleMax) return kFALSE;
+   return kTRUE;
+}
+
+void TBDisplay::NextSpill()
+{
+   Int_t is = (fCurSpill >= 0) ? fCurSpill : FindSpill(fCurEv);
+   for (is++; is < (Int_t)fSpills.size(); is++){
+      if (SpillInWindow(is)) break;
+   }
+   GotoSpill(is);
+}
+
+void TBDisplay::PrevSpill()
+{
+   Int_t is = (fCurSpill >= 0) ? fCurSpill : FindSpill(fCurEv);
+   for (is--; is >= 0; is--){
+      if (SpillInWindow(is)) break;
+   }
+   GotoSpill(is);
+}
+
+Bool_t TBDisplay::GotoSpill(Int_t is)
+{
+   // Overlay all selected events of one spill, summing the energy
+   // deposited in each cell, and show them as a single box set.
+
+   if (fChain == 0) return kFALSE;
+   Stop();
+
+   if (is < 0 || is >= (Int_t)fSpills.size())
+   {
+      Warning("GotoSpill", "Invalid spill index %d.", is);
+      return kFALSE;
+   }
+
+   DropEvent();
+
+   const SpillRange &r = fSpills[is];
+   cout << endl;
+   cout << "Going to spill " << r.spill << " (events " << r.first
+        << "-" << r.last << ")..." << endl;
+   cout << endl;
+
+   fCurSpill = is;
+   fCurEv = r.first;
+
+   struct CellSum { Float_t x, y, z, e; Int_t n; };
+   std::map<Int_t, CellSum> cells;
+   Int_t nev = 0;
+
+   for (Int_t ev=r.first; ev<=r.last; ev++){
+      Long64_t entry = evlist->GetEntry(ev);
+      if (Cut(entry) < 0) continue;
+      if (LoadTree(entry) < 0) continue;
+      fChain->GetEntry(entry);
+      if (fUseCalib) Recalibrate();
+      nev++;
+
+      for (int ihit=0; ihit<nhit_len; ihit++){
+         Int_t key = (hit_slab[ihit]*nchips + hit_chip[ihit])*nchans + hit_chan[ihit];
+         CellSum &c = cells[key];
+         c.x = hit_x[ihit];
+         c.y = hit_y[ihit];
+         c.z = hit_z[ihit];
+         c.e += hit_energy[ihit];
+         c.n++;
+      } // hit loop
+   } // event loop
+
+   Float_t emax = 10;
+   fLODCells.reserve(cells.size());
+   for (auto &kv : cells){
+      Int_t slab = kv.first / (nchips*nchans);
+      Int_t chip = (kv.first / nchans) % nchips;
+      Int_t chan = kv.first % nchans;
+      LODCell c = {kv.second.x, kv.second.y, kv.second.z, kv.second.e,
+                   slab, chip, chan, -1, 0, 0, kv.second.n, -1};
+      fLODCells.push_back(c);
+      emax = std::max(emax, kv.second.e);
+   }
+
+   cout << "Overlaid " << nev << " events (cycles " << r.cycleMin << "-"
+        << r.cycleMax << "), " << cells.size() << " cells." << endl;
+
+   BuildLOD(emax);
+
+   gEve->Redraw3D(kFALSE, kTRUE);
+
+   return kTRUE;
+}
+
+//______________________________________________________________________________
+void TBDisplay::BuildLOD(Float_t emax)
+{
+   // Group fLODCells into per-(slab, chip) blocks and build the coarse
+   // box set. The per-cell box set is only built once it is needed.
+
+   fLODBlocks.clear();
+   fEmaxFine   = emax;
+   fEmaxCoarse = emax;
+
+   std::map<Int_t, Int_t> index;
+   for (auto &c : fLODCells){
+      Int_t key = c.slab*nchips + c.chip;
+      auto it = index.find(key);
+      if (it == index.end()){
+         LODBlock b = {c.slab, c.chip, 0, c.x, c.x, c.y, c.y, c.z, 0, kFALSE};
+         it = index.insert(std::make_pair(key, (Int_t)fLODBlocks.size())).first;
+         fLODBlocks.push_back(b);
+      }
+      c.block = it->second;
+
+      LODBlock &b = fLODBlocks[c.block];
+      b.ncells++;
+      b.xmin = std::min(b.xmin, c.x);
+      b.xmax = std::max(b.xmax, c.x);
+      b.ymin = std::min(b.ymin, c.y);
+      b.ymax = std::max(b.ymax, c.y);
+      b.e += c.e;
+   } // cell loop
+
+   for (auto &b : fLODBlocks) fEmaxCoarse = std::max(fEmaxCoarse, b.e);
+
+   fHits_Coarse = MakeBlockSet();
+   gEve->AddElement(fHits_Coarse);
+
+   if (fLODTimer == 0) {
+      fLODTimer = new TTimer(200);
+      fLODTimer->Connect("Timeout()", "TBDisplay", this, "UpdateLOD()");
+   }
+   if (!fLODCells.empty()) fLODTimer->TurnOn();
 
-   bs->AddBox(hit_x[i], hit_y[i], hit_z[i],
-               5, 5, 0.5);
-   bs->DigitValue(hit_energy[i]);
+   // Until the viewer has rendered once the camera is not set up yet;
+   // keep the current level and let UpdateLOD() choose afterwards.
+   SetLODLevel(fLODRendered ? CellPixels() > fLODCellPixels : fLODFine);
+}
 
-   bs->SetName(TString::Format("hit_adc_high=%i\n hit_energy=%f\n hit_isHit=%i\n (%i,%i,%i,%i)",
-                                 hit_adc_high[i],
-                                 hit_energy[i],
-                                 hit_isHit[i],
-                                 hit_slab[i], hit_chip[i], hit_chan[i], hit_sca[i]));
+TEveBoxSet* TBDisplay::MakeBlockSet()
+{
+   // One summed-energy box per block that has not been expanded.
 
+   TEveBoxSet *bs = new TEveBoxSet("Blocks");
+   bs->SetPalette(LODPalette());
 
+   fCoarseDigitBlock.clear();
+   bs->Reset(TEveBoxSet::kBT_AABox, kFALSE, 64);
+   for (Int_t ib=0; ib<(Int_t)fLODBlocks.size(); ib++){
+      const LODBlock &b = fLODBlocks[ib];
+      if (b.expanded) continue;
+      bs->AddBox(b.xmin, b.ymin, b.z,
+                  b.xmax - b.xmin + 5, b.ymax - b.ymin + 5, 0.5);
+      bs->DigitValue(DigitOf(b.e, fEmaxCoarse));
+      bs->DigitUserData((void*)&b);
+      fCoarseDigitBlock.push_back(ib);
+   }
+   bs->SetTooltipCBFoo(BlockTooltip);
    bs->RefitPlex();
 
-   TEveTrans& t = bs->RefMainTrans();
-   t.SetPos(0,0,0);
+   // Picking a block expands it into its cells.
+   bs->SetPickable(1);
+   bs->SetAlwaysSecSelect(1);
+   bs->SetEmitSignals(kTRUE);
+   bs->Connect("SecSelected(TEveDigitSet*,Int_t)", "TBDisplay", this,
+               "ExpandBlock(TEveDigitSet*,Int_t)");
+
+   return bs;
+}
+
+void TBDisplay::RebuildBlocks()
+{
+   // Replace the block set, e.g. after a block has been expanded.
+
+   if (fHits_Coarse == 0) return;
+
+   fHits_Coarse->Destroy();
+   fHits_Coarse = MakeBlockSet();
+   fHits_Coarse->SetRnrSelf(!fLODFine);
+   gEve->AddElement(fHits_Coarse);
+
+   gEve->Redraw3D();
+}
+
+TEveBoxSet* TBDisplay::MakeCellSet(const char* name, Int_t block, Float_t emax)
+{
+   // One box per cell of fLODCells, restricted to a block if block >= 0,
+   // coloured on the [0, emax] scale of the level it is shown at.
+
+   TEveBoxSet *bs = new TEveBoxSet(name);
+   bs->SetPalette(LODPalette());
+
+   bs->Reset(TEveBoxSet::kBT_AABox, kFALSE, 64);
+   for (auto &c : fLODCells){
+      if (block >= 0 && c.block != block) continue;
+      bs->AddBox(c.x, c.y, c.z,
+                  5, 5, 0.5);
+      bs->DigitValue(DigitOf(c.e, emax));
+      bs->DigitUserData((void*)&c);
+   }
+   bs->SetTooltipCBFoo(CellTooltip);
+   bs->RefitPlex();
 
-   // Uncomment these two lines to get internal highlight / selection.
    bs->SetPickable(1);
    bs->SetAlwaysSecSelect(1);
 
+   return bs;
+}
+
+void TBDisplay::SetLODLevel(Bool_t fine)
+{
+   // Show either every cell, or the blocks plus any expanded blocks.
+
+   fLODFine = fine;
+   if (fHits_Coarse == 0) return;
+
+   if (fine && fHits_Box == 0) {
+      fHits_Box = MakeCellSet("Hits", -1, fEmaxFine);
+      gEve->AddElement(fHits_Box);
+   }
+
+   if (fHits_Box) fHits_Box->SetRnrSelf(fine);
+   fHits_Coarse->SetRnrSelf(!fine);
+   for (auto bs : fPickedSets) bs->SetRnrSelf(!fine);
+
+   ColorBar(fine ? fEmaxFine : fEmaxCoarse);
+}
+
+void TBDisplay::SetLODCellPixels(Float_t px)
+{
+   fLODCellPixels = px;
+   UpdateLOD();
+}
+
+Double_t TBDisplay::CellPixels()
+{
+   // Apparent height in pixels of a cell at the camera centre. Dolly
+   // (right-drag) and field of view (mouse wheel) both enter; they are
+   // read from the camera state, so no Apply() is needed. Orthographic
+   // cameras always get full detail.
+
+   TGLCamera &cam = gEve->GetDefaultGLViewer()->CurrentCamera();
+   TGLPerspectiveCamera *pcam = dynamic_cast<TGLPerspectiveCamera*>(&cam);
+   if (pcam == 0) return 1e6;
+
+   Double_t dolly = cam.RefCamTrans().GetTranslation().Mag();
+   Double_t half  = dolly * TMath::Tan(0.5 * pcam->GetFOV() * TMath::DegToRad());
+   if (half <= 0) return 1e6;
+
+   return CELL_SIZE * cam.RefViewport().Height() / (2 * half);
+}
+
+void TBDisplay::UpdateLOD()
+{
+   // Polled by fLODTimer; switch level when a cell crosses fLODCellPixels
+   // on screen, with 10% hysteresis to avoid flicker.
+
+   if (fHits_Coarse == 0) return;
+
+   if (!fLODRendered) {
+      if (gEve->GetDefaultGLViewer()->CurrentCamera().IsCacheDirty()) return;
+      fLODRendered = kTRUE;
+   }
+
+   Double_t px = CellPixels();
+   Bool_t fine = px > fLODCellPixels * (fLODFine ? 0.9 : 1.1);
+   if (fine == fLODFine) return;
+
+   SetLODLevel(fine);
+   gEve->Redraw3D();
+}
+
+void TBDisplay::ExpandBlock(TEveDigitSet* ds, Int_t idx)
+{
+   if (ds != fHits_Coarse || idx < 0 || idx >= (Int_t)fCoarseDigitBlock.size()) return;
+
+   Int_t ib = fCoarseDigitBlock[idx];
+   LODBlock &b = fLODBlocks[ib];
+   if (b.expanded) return;
+   b.expanded = kTRUE;
+
+   // Shown next to the blocks, so on the block scale of the colour bar.
+   TEveBoxSet *bs = MakeCellSet(Form("Slab %d chip %d", b.slab, b.chip), ib, fEmaxCoarse);
+   bs->SetRnrSelf(!fLODFine);
+   fPickedSets.push_back(bs);
    gEve->AddElement(bs);
 
+   // The block set emitted this signal, so replace it only once we are
+   // back in the event loop.
+   TTimer::SingleShot(0, "TBDisplay", this, "RebuildBlocks()");
 }
 
-void TBDisplay::ColorBar()
+//______________________________________________________________________________
+void TBDisplay::Calib() {
+
+	TString calib_file;
+	cout << "Calibration file: ";
+	cin >> calib_file;
+	cout << endl;
+
+   LoadCalibration(calib_file);
+
+}
+
+Bool_t TBDisplay::LoadCalibration(TString filename)
 {
-   TEveRGBAPalette *pal = new TEveRGBAPalette(0, 10);
-   pal->SetupColorArray();
-   auto po = new TEveRGBAPaletteOverlay(pal, 0.55, 0.1, 0.4, 0.05);
-   auto v  = gEve->GetDefaultGLViewer();
-   v->AddOverlayElement(po);
+   // Read a calibration set and re-colour the current event with it.
+   // One channel per line, '#' starts a comment:
+   //    slab chip chan sca ped_high ped_low mip_high gain
+   // where gain is the high/low gain ratio and sca = -1 fills all SCAs.
+   // Channels not listed get zero energy.
+
+   Stop();
+
+   std::ifstream in(filename.Data());
+   if (!in.is_open()) {
+      Error("LoadCalibration", "Cannot open %s.", filename.Data());
+      return kFALSE;
+   }
+
+   const Int_t ncells = nslabs*nchips*nchans*nscas;
+   std::vector<Float_t> ped_high(ncells+1, 0), ped_low(ncells+1, 0);
+   std::vector<Float_t> inv_mip(ncells+1, 0), gain(ncells+1, 0);
+
+   std::string line;
+   Int_t nline = 0, nchan = 0;
+   while (std::getline(in, line)) {
+      nline++;
+      if (line.empty() || line[0] == '#') continue;
+
+      std::istringstream ss(line);
+      Int_t slab, chip, chan, sca;
+      Float_t ph, pl, mip, g;
+      if (!(ss >> slab >> chip >> chan >> sca >> ph >> pl >> mip >> g)) {
+         Warning("LoadCalibration", "%s:%d: cannot parse line.", filename.Data(), nline);
+         continue;
+      }
+      if (slab < 0 || slab >= nslabs || chip < 0 || chip >= nchips ||
+          chan < 0 || chan >= nchans || sca < -1 || sca >= nscas || mip <= 0 || g <= 0) {
+         Warning("LoadCalibration", "%s:%d: invalid channel.", filename.Data(), nline);
+         continue;
+      }
+
+      Int_t first = (sca < 0) ? 0 : sca;
+      Int_t last  = (sca < 0) ? nscas - 1 : sca;
+      for (Int_t isca=first; isca<=last; isca++){
+         Int_t idx = ((slab*nchips + chip)*nchans + chan)*nscas + isca;
+         ped_high[idx] = ph;
+         ped_low[idx]  = pl;
+         inv_mip[idx]  = 1. / mip;
+         gain[idx]     = g;
+      }
+      nchan++;
+   }
+
+   if (nchan == 0) {
+      Error("LoadCalibration", "No valid entry in %s, calibration unchanged.", filename.Data());
+      return kFALSE;
+   }
+
+   fPedHigh.swap(ped_high);
+   fPedLow.swap(ped_low);
+   fInvMipHigh.swap(inv_mip);
+   fGain.swap(gain);
+   fUseCalib = kTRUE;
+
+   const Int_t nmax = sizeof(hit_energy) / sizeof(hit_energy[0]);
+   fHitPedHigh.resize(nmax);
+   fHitPedLow.resize(nmax);
+   fHitInvMip.resize(nmax);
+   fHitGain.resize(nmax);
+
+   cout << "Loaded " << nchan << " calibration entries from " << filename << endl;
+
+   Redisplay();
+   return kTRUE;
+}
+
+void TBDisplay::ClearCalibration()
+{
+   // Go back to hit_energy as stored in the file.
+
+   fUseCalib = kFALSE;
+   Redisplay();
+}
+
+void TBDisplay::SetGainSwitch(Int_t adc)
+{
+   fGainSwitch = adc;
+   if (fUseCalib) Redisplay();
+}
+
+void TBDisplay::Recalibrate()
+{
+   // Recompute hit_energy and hit_energy_lg (MIP) of the current entry
+   // from hit_adc_high/hit_adc_low, and their sums. The table lookups are
+   // gathered first so that the arithmetic runs branch-free over
+   // contiguous columns.
+
+   Float_t *ped_high = fHitPedHigh.data();
+   Float_t *ped_low  = fHitPedLow.data();
+   Float_t *inv_mip  = fHitInvMip.data();
+   Float_t *gain     = fHitGain.data();
+
+   const Int_t n = nhit_len;
+   const Int_t sentinel = fPedHigh.size() - 1;
+   const Int_t gain_switch = fGainSwitch;
+
+   for (int ihit=0; ihit<n; ihit++){
+      Int_t slab = hit_slab[ihit], chip = hit_chip[ihit];
+      Int_t chan = hit_chan[ihit], sca = hit_sca[ihit];
+      Int_t idx = ((slab*nchips + chip)*nchans + chan)*nscas + sca;
+      if (slab < 0 || slab >= nslabs || chip < 0 || chip >= nchips ||
+          chan < 0 || chan >= nchans || sca < 0 || sca >= nscas) idx = sentinel;
+
+      ped_high[ihit] = fPedHigh[idx];
+      ped_low[ihit]  = fPedLow[idx];
+      inv_mip[ihit]  = fInvMipHigh[idx];
+      gain[ihit]     = fGain[idx];
+   } // gather
+
+   Float_t sum = 0, sum_lg = 0;
+   for (int ihit=0; ihit<n; ihit++){
+      Float_t e_hg = (hit_adc_high[ihit] - ped_high[ihit]) * inv_mip[ihit];
+      Float_t e_lg = (hit_adc_low[ihit] - ped_low[ihit]) * gain[ihit] * inv_mip[ihit];
+      Float_t e    = (hit_adc_high[ihit] < gain_switch) ? e_hg : e_lg;
+      hit_energy[ihit]    = e;
+      hit_energy_lg[ihit] = e_lg;
+      sum    += e;
+      sum_lg += e_lg;
+   } // kernel
+
+   sum_energy    = sum;
+   sum_energy_lg = sum_lg;
+}
+
+void TBDisplay::Redisplay()
+{
+   // Rebuild whatever is shown, e.g. after a calibration or time window
+   // change. An event or spill outside the window moves on to the next
+   // one inside, or the previous one if there is none after it.
+
+   if (fCurSpill >= 0) {
+      Int_t is = fCurSpill;
+      while (is < (Int_t)fSpills.size() && !SpillInWindow(is)) is++;
+      if (is >= (Int_t)fSpills.size()) {
+         for (is = fCurSpill; is >= 0; is--)
+            if (SpillInWindow(is)) break;
+      }
+      if (is < 0) {
+         Warning("Redisplay", "No spill in the time window.");
+         return;
+      }
+      GotoSpill(is);
+   }
+   else if (fCurEv >= 0) {
+      Int_t ev = NextInWindow(fCurEv, 1);
+      if (ev < 0) ev = NextInWindow(fCurEv, -1);
+      if (ev < 0) {
+         Warning("Redisplay", "No event in the time window.");
+         return;
+      }
+      GotoEvent(ev);
+   }
+}
+
+//______________________________________________________________________________
+void TBDisplay::SetPlayRate(Float_t rate)
+{
+   if (rate <= 0) {
+      Warning("SetPlayRate", "Invalid rate %f.", rate);
+      return;
+   }
+   fPlayRate = rate;
+}
+
+void TBDisplay::Play()
+{
+   // Step through the selection at fPlayRate events/s, starting after
+   // the current event.
+
+   if (fChain == 0) return;
+   if (fPlayTimer && fPlayTimer->IsRunning()) return;
+
+   if (fPlayTimer == 0) {
+      fPlayTimer = new TTimer();
+      fPlayTimer->Connect("Timeout()", "TBDisplay", this, "PlayStep()");
+   }
+
+   fPlayNext = NextInWindow(fCurEv + 1, 1);
+   if (fPlayNext < 0) {
+      Warning("Play", "No further event in the time window.");
+      return;
+   }
+
+   fPlayFrame   = 0;
+   fPlayShown   = 0;
+   fPlayDropped = 0;
+   fPlayBuild   = 0;
+   fPlayLate    = 0;
+   fPlayDue     = -1;
+   fPlayT0      = (Long64_t)gSystem->Now();
+
+   cout << "Playing from " << fPlayNext << " at " << fPlayRate << " events/s" << endl;
+
+   fPlayTimer->Start(0, kTRUE);
+}
+
+void TBDisplay::Stop()
+{
+   if (fPlayTimer == 0 || fPlayT0 < 0) return;
+   fPlayTimer->Stop();
+
+   // The wall-clock rate is capped by the target. The sustainable rate
+   // comes from the mean cost of a frame: load+build, measured directly,
+   // plus render, seen as how late the timer fires after its slot. Render
+   // time that fits in the idle part of a frame is not seen, so at rates
+   // the machine keeps up with this is an upper bound.
+   Double_t elapsed = ((Long64_t)gSystem->Now() - fPlayT0) / 1000.;
+   Double_t rate    = elapsed > 0 ? fPlayShown / elapsed : 0;
+   Double_t build   = fPlayShown ? 1000. * fPlayBuild / fPlayShown : 0;
+   Double_t late    = fPlayShown ? (Double_t)fPlayLate / fPlayShown : 0;
+   fPlayT0 = -1;
+
+   cout << endl;
+   cout << "Played " << fPlayShown << " events in " << elapsed << " s: "
+        << rate << " events/s (target " << fPlayRate << "), "
+        << fPlayDropped << " dropped frames." << endl;
+   cout << "Mean frame cost " << build + late << " ms (load+build " << build
+        << " ms, render overrun " << late << " ms)";
+   if (build + late > 0) cout << ": sustainable ~" << 1000. / (build + late) << " events/s";
+   cout << endl;
+}
+
+void TBDisplay::PlayStep()
+{
+   // Frames are due on a fixed schedule of 1/fPlayRate s. If loading and
+   // building the previous event overran its budget, the frames whose slot
+   // has already passed are skipped and counted as dropped.
+
+   Double_t budget = 1000. / fPlayRate;
+   Long64_t now    = (Long64_t)gSystem->Now();
+
+   // Whatever ran in the event loop past the scheduled firing, mostly the
+   // GL render of the previous frame.
+   if (fPlayDue >= 0) fPlayLate += std::max(now - fPlayDue, (Long64_t)0);
+
+   Int_t due = (Int_t)((now - fPlayT0) / budget);
+   if (due > fPlayFrame) {
+      for (Int_t i=fPlayFrame; i<due && fPlayNext>=0; i++){
+         fPlayNext = NextInWindow(fPlayNext + 1, 1);
+         fPlayDropped++;
+      }
+      fPlayFrame = due;
+   }
+
+   if (fPlayNext < 0) {
+      Stop();
+      return;
+   }
+
+   fPlayWatch.Start(kTRUE);
+   if (GotoEvent(fPlayNext)) {
+      fPlayShown++;
+      fPlayBuild += fPlayWatch.RealTime();
+   }
+   fPlayFrame++;
+   fPlayNext = NextInWindow(fPlayNext + 1, 1);
+
+   Long64_t done = (Long64_t)gSystem->Now();
+   Long64_t wait = std::max(fPlayT0 + (Long64_t)(fPlayFrame * budget) - done, (Long64_t)1);
+   fPlayDue = done + wait;
+   fPlayTimer->Start(wait, kTRUE);
 }
 
 void TBDisplay::Display()